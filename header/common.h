@@ -3,6 +3,8 @@
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <map>
+#include <cfloat>
 #include <GL/glew.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -30,6 +32,54 @@ typedef struct {
   float m;
 } Point;
 
+/* How the height map is applied to a mesh */
+enum DisplaceMode {
+  DISP_NONE = 0, // normal mapping only
+  DISP_POM,      // parallax occlusion mapping in the fragment shader
+  DISP_TESS,     // true displacement in the tessellation stages
+  DISP_AUTO      // choose one of the above by distance to the eye
+};
+
+/* A linked shader program and its uniform locations */
+typedef struct {
+  GLuint id;
+  GLint uniModel, uniView, uniProjection;
+  GLint uniEyePoint, uniLightColors, uniLightPositions;
+  GLint uniTexBase, uniTexNormal;
+  GLint uniTexAO, uniTexRough;
+  GLint uniTexHeight, uniTexMetallic;
+  GLint uniTessScale, uniDispScale;
+} Program;
+
+/* Compile-time switches of a shader permutation,
+   injected into the glsl sources as #defines */
+typedef struct {
+  int numLights;
+  bool useBaseMap, useNormalMap, useAOMap, useRoughMap;
+  bool useMetallic; // metallic workflow with texMetallic
+  bool useTonemap;  // HDR tonemapping and gamma correction
+  bool useTess;     // displacement by tcsQuad/tesQuad
+  bool usePOM;      // parallax occlusion mapping
+} ShaderVariant;
+
+/* Tessellated, displaced geometry of a mesh captured by transform feedback
+   at one tessellation level, in object space */
+typedef struct {
+  float dispScale; // world-space displacement the vertices were captured with
+  GLuint texHeight; // height map they were captured with, see tboHeight
+  GLuint tfo, vbo, vao;
+} TessCache;
+
+/* Vertex streams read by readObj, already in the layout of Mesh's vbos.
+   Every face is 4 corners (one GL_PATCHES quad), other polygons are
+   fanned into triangles stored as quads with a repeated last corner. */
+typedef struct {
+  vector<GLfloat> vtxs; // 3 per corner
+  vector<GLfloat> uvs;  // 2 per corner
+  vector<GLfloat> nmls; // 3 per corner
+  int numVtxs;
+} ObjData;
+
 class Mesh {
 public:
   // mesh data
@@ -38,15 +88,12 @@ public:
 
   // opengl data
   vector<GLuint> vboVtxs, vboUvs, vboNmls;
+  vector<GLuint> ibos; // quads split into triangles, for the non-tess path
   vector<GLuint> vaos;
+  vector<int> numVtxs;
 
-  GLuint shader;
-  GLuint tboBase, tboNormal, tboAO, tboRough, tboHeight;
-  GLint uniModel, uniView, uniProjection;
-  GLint uniEyePoint, uniLightColors, uniLightPositions;
-  GLint uniTexBase, uniTexNormal;
-  GLint uniTexAO, uniTexRough;
-  GLint uniTexHeight;
+  // material, a texture is present when its tbo is not 0
+  GLuint tboBase, tboNormal, tboAO, tboRough, tboHeight, tboMetallic;
 
   // aabb
   vec3 min, max;
@@ -55,6 +102,31 @@ public:
 
   // pbr test
   bool isPBR;
+  int numLights;
+  bool tonemap;
+
+  // displacement policy
+  // with DISP_AUTO, use tessellation within tessDist,
+  // POM within pomDist, and plain normal mapping beyond
+  DisplaceMode displaceMode;
+  float tessDist, pomDist;
+
+  // runtime quality knobs of tcsQuad/tesQuad
+  float tessScale; // multiplies the tessellation levels
+  float dispScale; // displacement along the normal, also the POM depth
+
+  // transform feedback cache of the tessellated, displaced geometry,
+  // for static meshes: the post-TES triangles are captured in object space
+  // once per level bucket and model scale, and replayed with the plain vs,
+  // so instances share them; re-captured when dispScale or the height map
+  // changes
+  bool useTessCache;
+  float cacheMaxLevel; // caps the memory, 6 * level^2 vertices per quad
+                       // in each bucket
+  map<pair<float, float>, TessCache> tessCaches; // keyed by level, scale
+  GLuint shaderCapture;
+  GLint uniCaptureModel, uniCaptureTessLevel, uniCaptureTexHeight;
+  GLint uniCaptureDispScale;
 
   /* Constructors */
   Mesh(const string, bool = false);
@@ -62,17 +134,106 @@ public:
 
   /* Member functions */
   void initBuffers();
-  void initShader();
-  void initUniform();
-  void draw(mat4, mat4, mat4, vec3, vec3[], vec3[], int, int, int, int, int);
+  void initBuffers(ObjData &);
+  void addBuffers(GLfloat *, GLfloat *, GLfloat *, int);
+  void getShaderFiles(const ShaderVariant &, string &, string &, string &,
+                      string &);
+  void initUniform(Program &, const ShaderVariant &);
+  Program &getProgram(const ShaderVariant &);
+  ShaderVariant getVariant(DisplaceMode);
+  void draw(mat4, mat4, mat4, vec3, vec3[], vec3[], int, int, int, int, int,
+            int);
   void setTexture(GLuint &, int, const string, FREE_IMAGE_FORMAT);
+  DisplaceMode selectDisplaceMode(mat4, vec3);
+  float eyeDistance(mat4, vec3);
+  float modelScale(mat4);
+  float getTessLevel(float);
+  void initCapture();
+  TessCache &getTessCache(float, float, int);
+  void captureTess(TessCache &, float, float, int);
+};
+
+/* Offscreen color and depth target, multisampled only when samples > 0.
+   Render into it after bind(), resolve() leaves the image in fbo. */
+class RenderTarget {
+public:
+  int width, height, samples;
+  GLuint fboMS, rboMSColor, rboMSDepth;
+  GLuint fbo, rboColor, rboDepth;
+
+  /* Constructors */
+  RenderTarget();
+  ~RenderTarget();
+
+  /* Member functions */
+  void init(int, int, int);
+  void release();
+  void bind();
+  void resolve();
+};
+
+/* One step of the quality ladder */
+typedef struct {
+  float renderScale; // internal resolution relative to the framebuffer
+  int samples;       // MSAA samples of the offscreen target, 0 for none
+  float tessScale;   // see Mesh::tessScale
+} QualityLevel;
+
+/* Measures the GPU frame time and walks the quality ladder
+   to keep it within a budget.
+   The scene is rendered into an offscreen target at the internal
+   resolution, then resolved and upscaled into the default framebuffer. */
+class QualityController {
+public:
+  vector<QualityLevel> levels; // best first
+  int level;
+
+  float budget;    // ms
+  float frameTime; // smoothed GPU frame time, ms
+  int cooldown;    // frames left before the next change
+  int frame;
+
+  // settled frame time last measured at each level, 0 if never,
+  // and the frame it was measured on
+  vector<float> levelTimes;
+  vector<int> levelFrames;
+
+  // GL_TIME_ELAPSED queries, read back a few frames late to avoid stalls
+  static const int NUM_QUERIES = 4;
+  GLuint queries[NUM_QUERIES];
+  bool queryIssued[NUM_QUERIES];
+  int queryIdx;
+
+  // offscreen target at the internal resolution
+  RenderTarget target;
+
+  /* Constructors */
+  QualityController(float);
+  ~QualityController();
+
+  /* Member functions */
+  const QualityLevel &current();
+  void beginFrame(int, int);
+  void endFrame(int, int);
+  void readQueries();
+  void adapt();
+  bool worthTrying(int);
+  string stats();
 };
 
 string readFile(const string);
 void printLog(GLuint &);
 GLint myGetUniformLocation(GLuint &, string);
-GLuint buildShader(string, string, string = "", string = "");
-GLuint compileShader(string, GLenum);
-GLuint linkShader(GLuint, GLuint, GLuint, GLuint);
+GLuint buildShader(string, string, string = "", string = "", string = "");
+GLuint compileShader(string, GLenum, string = "");
+GLuint linkShader(GLuint, GLuint, GLuint, GLuint,
+                  const vector<const GLchar *> & = vector<const GLchar *>());
+GLuint buildFeedbackShader(string, string, string, string,
+                           const vector<const GLchar *> &);
 void drawBox(vec3, vec3);
 void drawPoints(vector<Point> &);
+string getDefines(const ShaderVariant &);
+void releasePrograms();
+bool readObj(const string, ObjData &, int = 0);
+GLuint loadTexture(const string, FREE_IMAGE_FORMAT = FIF_UNKNOWN);
+int runBatch(const string);
@@ -6,29 +6,42 @@ in vec2 uv;
 in vec3 worldPos;
 in vec3 worldN;
 
+// Shader permutation switches, injected by Mesh::initShader:
+// NUM_LIGHTS, USE_BASE_MAP, USE_NORMAL_MAP, USE_ROUGH_MAP, USE_AO_MAP,
+// USE_METALLIC, USE_POM, USE_TONEMAP (USE_TESS only selects the stages)
+#ifndef NUM_LIGHTS
+#define NUM_LIGHTS 4
+#endif
+
 // material parameters
 uniform sampler2D texBase;
 uniform sampler2D texNormal;
-// uniform sampler2D metallicMap;
+uniform sampler2D texMetallic;
 uniform sampler2D texRough;
 uniform sampler2D texAO;
 uniform sampler2D texHeight;
 
 // lights
-uniform vec3 lightPositions[4];
-uniform vec3 lightColors[4];
+uniform vec3 lightPositions[NUM_LIGHTS];
+uniform vec3 lightColors[NUM_LIGHTS];
 
 uniform vec3 eyePoint;
 
 const float PI = 3.14159265359;
+
+// parallax occlusion mapping
+// same displacement scale as tesQuad, so both paths match at tessDist
+uniform float dispScale;
+
+// the number of layers goes from max to min as the view becomes head-on
+const float pomMinLayers = 8.0;
+const float pomMaxLayers = 32.0;
 // ----------------------------------------------------------------------------
 // Easy trick to get tangent-normals to world-space to keep PBR code simplified.
 // Don't worry if you don't get what's going on; you generally want to do normal
 // mapping the usual way for performance anways; I do plan make a note of this
 // technique somewhere later in the normal mapping tutorial.
-vec3 getNormalFromMap() {
-  vec3 tangentNormal = texture(texNormal, uv).xyz * 2.0 - 1.0;
-
+mat3 getTBN() {
   vec3 Q1 = dFdx(worldPos);
   vec3 Q2 = dFdy(worldPos);
   vec2 st1 = dFdx(uv);
@@ -37,10 +50,65 @@ vec3 getNormalFromMap() {
   vec3 N = normalize(worldN);
   vec3 T = normalize(Q1 * st2.t - Q2 * st1.t);
   vec3 B = -normalize(cross(N, T));
-  mat3 TBN = mat3(T, B, N);
+
+  return mat3(T, B, N);
+}
+
+vec3 getNormalFromMap(mat3 TBN, vec2 texUv) {
+  vec3 tangentNormal = texture(texNormal, texUv).xyz * 2.0 - 1.0;
 
   return normalize(TBN * tangentNormal);
 }
+#ifdef USE_POM
+// ----------------------------------------------------------------------------
+// Ray-march the height map along the tangent-space view direction and
+// return the uv where the ray first goes below the surface.
+// tesQuad moves the surface by (h * 2 - 1) * dispScale along the normal,
+// so the height field spans 2 * dispScale world units with the geometric
+// surface at h = 0.5. The march starts on its top (h = 1), where
+// depth = 1 - h, and goes down to its bottom (h = 0).
+// textureGrad is used because the loop is non-uniform control flow.
+vec2 parallaxOcclusionMapping(vec2 texUv, vec3 viewTS) {
+  float numLayers = mix(pomMaxLayers, pomMinLayers, abs(viewTS.z));
+  float layerDepth = 1.0 / numLayers;
+
+  vec2 dx = dFdx(texUv);
+  vec2 dy = dFdy(texUv);
+
+  // world units to uv units, assuming a roughly isotropic parameterization
+  float worldLen = length(dFdx(worldPos)) + length(dFdy(worldPos));
+  float uvPerWorld = (length(dx) + length(dy)) / max(worldLen, 1e-6);
+
+  // uv offset of the view ray over the whole height range
+  vec2 shift =
+      viewTS.xy / max(viewTS.z, 0.1) * 2.0 * dispScale * uvPerWorld;
+  vec2 deltaUv = shift / numLayers;
+
+  // the ray crosses the top half a range before the geometric surface
+  vec2 curUv = texUv + shift * 0.5;
+  float curLayerDepth = 0.0;
+  float curDepth = 1.0 - textureGrad(texHeight, curUv, dx, dy).r;
+
+  for (int i = 0; i < int(pomMaxLayers); ++i) {
+    if (curLayerDepth >= curDepth) {
+      break;
+    }
+
+    curUv -= deltaUv;
+    curDepth = 1.0 - textureGrad(texHeight, curUv, dx, dy).r;
+    curLayerDepth += layerDepth;
+  }
+
+  // interpolate between the layers before and after the hit
+  vec2 prevUv = curUv + deltaUv;
+  float afterDepth = curDepth - curLayerDepth;
+  float beforeDepth = 1.0 - textureGrad(texHeight, prevUv, dx, dy).r -
+                      curLayerDepth + layerDepth;
+  float weight = afterDepth / (afterDepth - beforeDepth);
+
+  return mix(curUv, prevUv, weight);
+}
+#endif
 // ----------------------------------------------------------------------------
 float DistributionGGX(vec3 N, vec3 H, float roughness) {
   float a = roughness * roughness;
@@ -79,25 +147,62 @@ vec3 fresnelSchlick(float cosTheta, vec3 F0) {
 }
 // ----------------------------------------------------------------------------
 void main() {
-  // vec3 albedo = pow(texture(texBase, uv).rgb, vec3(2.2));
-  vec3 albedo = texture(texBase, uv).rgb;
-  // float metallic  = texture(metallicMap, uv).r;
-  float roughness = texture(texRough, uv).r;
-  float ao = texture(texAO, uv).r;
+  vec3 V = normalize(eyePoint - worldPos);
 
-  vec3 N = getNormalFromMap();
+  vec2 texUv = uv;
 
-  vec3 V = normalize(eyePoint - worldPos);
+#if defined(USE_NORMAL_MAP) || defined(USE_POM)
+  mat3 TBN = getTBN();
+#endif
+
+#ifdef USE_POM
+  // getTBN flips B to -dP/dv for the normal maps, the ray march needs
+  // +dP/dv or the parallax is mirrored along v
+  vec3 pomB = normalize(cross(TBN[2], TBN[0]));
+  mat3 pomTBN = mat3(TBN[0], pomB, TBN[2]);
+
+  // nearly orthonormal, so use its transpose as the inverse
+  texUv = parallaxOcclusionMapping(uv, normalize(transpose(pomTBN) * V));
+#endif
+
+#ifdef USE_BASE_MAP
+  // vec3 albedo = pow(texture(texBase, texUv).rgb, vec3(2.2));
+  vec3 albedo = texture(texBase, texUv).rgb;
+#else
+  vec3 albedo = vec3(0.5);
+#endif
+
+#ifdef USE_ROUGH_MAP
+  float roughness = texture(texRough, texUv).r;
+#else
+  float roughness = 0.5;
+#endif
+
+#ifdef USE_AO_MAP
+  float ao = texture(texAO, texUv).r;
+#else
+  float ao = 1.0;
+#endif
+
+#ifdef USE_NORMAL_MAP
+  vec3 N = getNormalFromMap(TBN, texUv);
+#else
+  vec3 N = normalize(worldN);
+#endif
 
   // calculate reflectance at normal incidence; if dia-electric (like plastic)
   // use F0 of 0.04 and if it's a metal, use the albedo color as F0 (metallic
   // workflow)
   vec3 F0 = vec3(0.55);
-  // F0 = mix(F0, albedo, metallic);
+
+#ifdef USE_METALLIC
+  float metallic = texture(texMetallic, texUv).r;
+  F0 = mix(F0, albedo, metallic);
+#endif
 
   // reflectance equation
   vec3 Lo = vec3(0.0);
-  for (int i = 0; i < 4; ++i) {
+  for (int i = 0; i < NUM_LIGHTS; ++i) {
     // calculate per-light radiance
     vec3 L = normalize(lightPositions[i] - worldPos);
     vec3 H = normalize(V + L);
@@ -124,7 +229,9 @@ void main() {
     // multiply kD by the inverse metalness such that only non-metals
     // have diffuse lighting, or a linear blend if partly metal (pure metals
     // have no diffuse light).
-    // kD *= 1.0 - metallic;
+#ifdef USE_METALLIC
+    kD *= 1.0 - metallic;
+#endif
 
     // scale light by NdotL
     float NdotL = max(dot(N, L), 0.0);
@@ -142,10 +249,12 @@ void main() {
   vec3 color = ambient + Lo;
   // color = Lo;
 
-  // // HDR tonemapping
-  // color = color / (color + vec3(1.0));
-  // // gamma correct
-  // color = pow(color, vec3(1.0 / 2.2));
+#ifdef USE_TONEMAP
+  // HDR tonemapping
+  color = color / (color + vec3(1.0));
+  // gamma correct
+  color = pow(color, vec3(1.0 / 2.2));
+#endif
 
   outputColor = vec4(color, 1.0);
 }
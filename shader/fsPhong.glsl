@@ -4,9 +4,13 @@ in vec2 uv;
 in vec3 worldPos;
 in vec3 worldN;
 
+#ifndef NUM_LIGHTS
+#define NUM_LIGHTS 4
+#endif
+
 uniform sampler2D texBase, texNormal;
-uniform vec3 lightPositions[4];
-uniform vec3 lightColors[4];
+uniform vec3 lightPositions[NUM_LIGHTS];
+uniform vec3 lightColors[NUM_LIGHTS];
 uniform vec3 eyePoint;
 
 out vec4 outputColor;
@@ -43,7 +47,7 @@ void main(){
 
     outputColor = vec4(0);
 
-    for(int i = 0; i < 4; i++){
+    for(int i = 0; i < NUM_LIGHTS; i++){
         float scale = 0.01;
 
         vec4 ambient = vec4(lightColors[i] * ka, 1.0) * scale;
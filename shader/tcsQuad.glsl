@@ -12,9 +12,17 @@ out vec3 esInWorldPos[];
 out vec2 esInUv[];
 out vec3 esInN[];
 
+#ifdef FIXED_TESS_LEVEL
+// one level for every edge, used when capturing into the tessellation cache
+uniform float tessLevel;
+#endif
+
 float baseDist = 4.0;
 float baseLevel = 1.0;
 
+// runtime quality knob, set by QualityController
+uniform float tessScale;
+
 float getTessLevel(float dist0, float dist1) {
   float avgDist = (dist0 + dist1) / 2.0;
 
@@ -33,21 +41,36 @@ float getTessLevel(float dist0, float dist1) {
   }
 }
 
+float scaleLevel(float level) { return max(level * tessScale, 1.0); }
+
 void main() {
   esInUv[gl_InvocationID] = uv[gl_InvocationID];
   esInN[gl_InvocationID] = worldN[gl_InvocationID];
   esInWorldPos[gl_InvocationID] = worldPos[gl_InvocationID];
 
   if (gl_InvocationID == 0) {
+#ifdef FIXED_TESS_LEVEL
+    gl_TessLevelOuter[0] = tessLevel;
+    gl_TessLevelOuter[1] = tessLevel;
+    gl_TessLevelOuter[2] = tessLevel;
+    gl_TessLevelOuter[3] = tessLevel;
+
+    gl_TessLevelInner[0] = tessLevel;
+    gl_TessLevelInner[1] = tessLevel;
+#else
     float eyeToVtxDist0 = distance(eyePoint, esInWorldPos[0]);
     float eyeToVtxDist1 = distance(eyePoint, esInWorldPos[1]);
     float eyeToVtxDist2 = distance(eyePoint, esInWorldPos[2]);
     float eyeToVtxDist3 = distance(eyePoint, esInWorldPos[3]);
 
-    gl_TessLevelOuter[0] = getTessLevel(eyeToVtxDist3, eyeToVtxDist0);
-    gl_TessLevelOuter[1] = getTessLevel(eyeToVtxDist0, eyeToVtxDist1);
-    gl_TessLevelOuter[2] = getTessLevel(eyeToVtxDist1, eyeToVtxDist2);
-    gl_TessLevelOuter[3] = getTessLevel(eyeToVtxDist2, eyeToVtxDist3);
+    gl_TessLevelOuter[0] =
+        scaleLevel(getTessLevel(eyeToVtxDist3, eyeToVtxDist0));
+    gl_TessLevelOuter[1] =
+        scaleLevel(getTessLevel(eyeToVtxDist0, eyeToVtxDist1));
+    gl_TessLevelOuter[2] =
+        scaleLevel(getTessLevel(eyeToVtxDist1, eyeToVtxDist2));
+    gl_TessLevelOuter[3] =
+        scaleLevel(getTessLevel(eyeToVtxDist2, eyeToVtxDist3));
 
     float avg = (gl_TessLevelOuter[0] + gl_TessLevelOuter[1] +
                  gl_TessLevelOuter[2] + gl_TessLevelOuter[3]) *
@@ -55,5 +78,6 @@ void main() {
 
     gl_TessLevelInner[0] = avg;
     gl_TessLevelInner[1] = avg;
+#endif
   }
 }
@@ -6,6 +6,9 @@ uniform mat4 V, P;
 
 uniform sampler2D texHeight;
 
+// displacement scale, a runtime quality knob
+uniform float dispScale;
+
 in vec3 esInWorldPos[];
 in vec2 esInUv[];
 in vec3 esInN[];
@@ -40,10 +43,9 @@ void main() {
   uv = interpolate(esInUv[0], esInUv[1], esInUv[2], esInUv[3]);
   worldN = interpolate(esInN[0], esInN[1], esInN[2], esInN[3]);
 
-  float scale = 0.1;
   float offset = texture(texHeight, uv).r * 2.0 - 1.0;
-  // worldPos.y += offset * scale;
-  worldPos += normalize(worldN) * offset * scale;
+  // worldPos.y += offset * dispScale;
+  worldPos += normalize(worldN) * offset * dispScale;
 
   gl_Position = P * V * vec4(worldPos, 1.0);
 }
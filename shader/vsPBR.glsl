@@ -7,13 +7,17 @@ out vec2 uv;
 out vec3 worldPos;
 out vec3 worldN;
 
-uniform mat4 M;
+uniform mat4 M, V, P;
 
 void main() {
   uv = vtxUv;
 
+  // also replays the tessellation cache, captured in object space
   worldPos = (M * vec4(vtxCoord, 1.0)).xyz;
 
   worldN = (vec4(vtxN, 1.0) * inverse(M)).xyz;
   worldN = normalize(worldN);
+
+  // only used without tessellation, otherwise tesQuad overwrites it
+  gl_Position = P * V * vec4(worldPos, 1.0);
 }
@@ -0,0 +1,473 @@
+#include "common.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+/* Batch material preview renderer
+   usage: ./main --batch jobs.txt
+
+   One job per line, # starts a comment:
+     mesh materials rigs eyeX eyeY eyeZ width height output
+   e.g.
+     ./mesh/sphereQuad.obj stone,rock key,rim 0 2 6 256 256 ./%m_%r.png
+
+   materials and rigs are comma-separated lists, one image is rendered for
+   every combination, %m and %r in output are replaced by their names.
+   A material is the set of ./res/<name>_{base,normal,ao,roughness,height,
+   metallic}.jpg present on disk.
+
+   One hidden context renders every job. Meshes, their shader permutations
+   and textures are cached across jobs. Each frame is read back through
+   two PBOs, so the readback of a job overlaps the rendering of the next,
+   and the images are encoded on worker threads. */
+
+// texture units, as in the viewer
+const int UNIT_BASE = 12, UNIT_NORMAL = 13, UNIT_AO = 14, UNIT_ROUGH = 15,
+          UNIT_HEIGHT = 16, UNIT_METALLIC = 17;
+
+const int BATCH_SAMPLES = 4;
+
+typedef struct {
+  string mesh, material, rig, output;
+  vec3 eye;
+  int width, height;
+} Job;
+
+typedef struct {
+  GLuint base, normal, ao, rough, height, metallic;
+} Material;
+
+typedef struct {
+  vec3 positions[4];
+  vec3 colors[4];
+} LightRig;
+
+typedef struct {
+  vector<BYTE> pixels; // BGRA, bottom-up
+  int width, height;
+  string output;
+} EncodeTask;
+
+static map<string, LightRig> lightRigs = {
+    // the viewer's lights
+    {"default",
+     {{vec3(3.f, 3.f, 3.f), vec3(3.f, 3.f, -3.f), vec3(3.f, -3.f, 3.f),
+       vec3(-3.f, 3.f, 3.f)},
+      {vec3(10.f), vec3(20.f), vec3(30.f), vec3(40.f)}}},
+    // one strong key light, weak fills
+    {"key",
+     {{vec3(4.f, 4.f, 4.f), vec3(-4.f, 1.f, 4.f), vec3(0.f, -4.f, 4.f),
+       vec3(0.f, 4.f, -4.f)},
+      {vec3(60.f), vec3(8.f), vec3(4.f), vec3(8.f)}}},
+    // lit from behind
+    {"rim",
+     {{vec3(3.f, 2.f, -4.f), vec3(-3.f, 2.f, -4.f), vec3(0.f, -3.f, -4.f),
+       vec3(0.f, 3.f, 4.f)},
+      {vec3(40.f), vec3(40.f), vec3(20.f), vec3(5.f)}}}};
+
+/* Encoder threads */
+static deque<EncodeTask> encodeQueue;
+static size_t encodeCapacity; // frames waiting at most, bounds the memory
+static mutex encodeMutex;
+static condition_variable encodeCond;      // a task or encodeDone is ready
+static condition_variable encodeSpaceCond; // the queue has room
+static bool encodeDone = false;
+
+static void encodeWorker() {
+  while (true) {
+    EncodeTask task;
+
+    {
+      unique_lock<mutex> lock(encodeMutex);
+      encodeCond.wait(lock,
+                      [] { return !encodeQueue.empty() || encodeDone; });
+
+      if (encodeQueue.empty()) {
+        return;
+      }
+
+      task = move(encodeQueue.front());
+      encodeQueue.pop_front();
+    }
+    encodeSpaceCond.notify_one();
+
+    FIBITMAP *image = FreeImage_ConvertFromRawBits(
+        task.pixels.data(), task.width, task.height, task.width * 4, 32,
+        FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, FALSE);
+
+    FREE_IMAGE_FORMAT fif = FreeImage_GetFIFFromFilename(task.output.c_str());
+    if (fif == FIF_UNKNOWN) {
+      fif = FIF_PNG;
+    }
+
+    // jpeg can't store alpha
+    if (fif == FIF_JPEG) {
+      FIBITMAP *rgb = FreeImage_ConvertTo24Bits(image);
+      FreeImage_Unload(image);
+      image = rgb;
+    }
+
+    if (!FreeImage_Save(fif, image, task.output.c_str())) {
+      cerr << "runBatch: Can't write " << task.output << endl;
+    }
+
+    FreeImage_Unload(image);
+  }
+}
+
+// block the render loop while the encoders are encodeCapacity frames behind
+static void waitEncodeSpace() {
+  unique_lock<mutex> lock(encodeMutex);
+  encodeSpaceCond.wait(lock,
+                       [] { return encodeQueue.size() < encodeCapacity; });
+}
+
+// the caller waited for space, it is the only producer
+static void pushEncodeTask(EncodeTask &task) {
+  {
+    lock_guard<mutex> lock(encodeMutex);
+    encodeQueue.push_back(move(task));
+  }
+  encodeCond.notify_one();
+}
+
+/* Job list */
+static vector<string> split(const string &s, char delim) {
+  vector<string> parts;
+  stringstream ss(s);
+  string part;
+
+  while (getline(ss, part, delim)) {
+    if (part != "")
+      parts.push_back(part);
+  }
+
+  return parts;
+}
+
+static void replaceAll(string &s, const string &from, const string &to) {
+  for (size_t pos = s.find(from); pos != string::npos;
+       pos = s.find(from, pos + to.size())) {
+    s.replace(pos, from.size(), to);
+  }
+}
+
+static bool readJobs(const string jobFile, vector<Job> &jobs) {
+  ifstream in(jobFile.c_str());
+  if (!in) {
+    cerr << "runBatch: Can't open " << jobFile << endl;
+    return false;
+  }
+
+  string line;
+  int lineNum = 0;
+
+  while (getline(in, line)) {
+    lineNum++;
+    line = line.substr(0, line.find('#'));
+
+    stringstream ss(line);
+    string mesh, materials, rigs, output;
+    vec3 eye;
+    int width, height;
+
+    if (!(ss >> mesh)) {
+      continue; // blank
+    }
+
+    if (!(ss >> materials >> rigs >> eye.x >> eye.y >> eye.z >> width >>
+          height >> output) ||
+        width <= 0 || height <= 0) {
+      cerr << "runBatch: " << jobFile << ":" << lineNum << ": Bad job" << endl;
+      return false;
+    }
+
+    for (auto &m : split(materials, ',')) {
+      for (auto &r : split(rigs, ',')) {
+        if (lightRigs.find(r) == lightRigs.end()) {
+          cerr << "runBatch: " << jobFile << ":" << lineNum
+               << ": Unknown light rig " << r << endl;
+          return false;
+        }
+
+        Job job = {mesh, m, r, output, eye, width, height};
+        replaceAll(job.output, "%m", m);
+        replaceAll(job.output, "%r", r);
+        jobs.push_back(job);
+      }
+    }
+  }
+
+  return true;
+}
+
+/* Caches */
+// NULL if the mesh failed to load, cached too so it is only tried once
+static Mesh *getMesh(map<string, Mesh *> &meshes, const string fileName) {
+  auto it = meshes.find(fileName);
+
+  if (it == meshes.end()) {
+    Mesh *mesh = new Mesh(fileName, true);
+
+    int numVtxs = 0;
+    for (auto n : mesh->numVtxs) {
+      numVtxs += n;
+    }
+
+    if (numVtxs == 0) {
+      cerr << "runBatch: Can't load mesh " << fileName << endl;
+      delete mesh;
+      mesh = NULL;
+    } else {
+      // offline, so always the best displacement
+      mesh->displaceMode = DISP_TESS;
+    }
+
+    it = meshes.insert(make_pair(fileName, mesh)).first;
+  }
+
+  return it->second;
+}
+
+static Material &getMaterial(map<string, Material> &materials,
+                             const string name) {
+  auto it = materials.find(name);
+
+  if (it == materials.end()) {
+    string prefix = "./res/" + name;
+    Material m;
+
+    // missing maps stay 0, the shader permutation drops them
+    m.base = loadTexture(prefix + "_base.jpg");
+    m.normal = loadTexture(prefix + "_normal.jpg");
+    m.ao = loadTexture(prefix + "_ao.jpg");
+    m.rough = loadTexture(prefix + "_roughness.jpg");
+    m.height = loadTexture(prefix + "_height.jpg");
+    m.metallic = loadTexture(prefix + "_metallic.jpg");
+
+    if (m.base == 0) {
+      cerr << "runBatch: No base color for material " << name << endl;
+    }
+
+    it = materials.insert(make_pair(name, m)).first;
+  }
+
+  return it->second;
+}
+
+static void bindTexture(int unit, GLuint tbo) {
+  glActiveTexture(GL_TEXTURE0 + unit);
+  glBindTexture(GL_TEXTURE_2D, tbo);
+}
+
+/* Rendering */
+static void renderJob(const Job &job, Mesh *mesh, const Material &mat) {
+  LightRig &rig = lightRigs[job.rig];
+
+  mesh->tboBase = mat.base;
+  mesh->tboNormal = mat.normal;
+  mesh->tboAO = mat.ao;
+  mesh->tboRough = mat.rough;
+  mesh->tboHeight = mat.height;
+  mesh->tboMetallic = mat.metallic;
+
+  bindTexture(UNIT_BASE, mat.base);
+  bindTexture(UNIT_NORMAL, mat.normal);
+  bindTexture(UNIT_AO, mat.ao);
+  bindTexture(UNIT_ROUGH, mat.rough);
+  bindTexture(UNIT_HEIGHT, mat.height);
+  bindTexture(UNIT_METALLIC, mat.metallic);
+
+  mat4 M = mat4(1.f);
+  mat4 V = lookAt(job.eye, vec3(0.f), vec3(0.f, 1.f, 0.f));
+  mat4 P = perspective(radians(45.f), 1.f * job.width / job.height, 0.01f,
+                       1000.f);
+
+  glClearColor(0.f, 0.f, 0.f, 0.f);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+  mesh->draw(M, V, P, job.eye, rig.colors, rig.positions, UNIT_BASE,
+             UNIT_NORMAL, UNIT_AO, UNIT_ROUGH, UNIT_HEIGHT, UNIT_METALLIC);
+}
+
+// map the pbo of a finished job and queue its pixels for encoding
+static void collectJob(const Job &job, GLuint pbo) {
+  size_t size = size_t(job.width) * job.height * 4;
+
+  waitEncodeSpace();
+
+  EncodeTask task;
+  task.width = job.width;
+  task.height = job.height;
+  task.output = job.output;
+  task.pixels.resize(size);
+
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+  void *data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+
+  if (data) {
+    memcpy(task.pixels.data(), data, size);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  }
+
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  pushEncodeTask(task);
+}
+
+int runBatch(const string jobFile) {
+  vector<Job> jobs;
+  if (!readJobs(jobFile, jobs)) {
+    return EXIT_FAILURE;
+  }
+
+  // hidden window, only for its context
+  if (!glfwInit()) {
+    fprintf(stderr, "Failed to initialize GLFW\n");
+    return EXIT_FAILURE;
+  }
+
+  glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+  glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+  GLFWwindow *window = glfwCreateWindow(64, 64, "PBR batch", NULL, NULL);
+  if (window == NULL) {
+    std::cout << "Failed to open GLFW window." << std::endl;
+    glfwTerminate();
+    return EXIT_FAILURE;
+  }
+
+  glfwMakeContextCurrent(window);
+
+  glewExperimental = GL_TRUE;
+  if (glewInit() != GLEW_OK) {
+    fprintf(stderr, "Failed to initialize GLEW\n");
+    glfwTerminate();
+    return EXIT_FAILURE;
+  }
+
+  FreeImage_Initialise(true);
+
+  glEnable(GL_CULL_FACE);
+  glEnable(GL_DEPTH_TEST);
+  glPatchParameteri(GL_PATCH_VERTICES, 4);
+  glPixelStorei(GL_PACK_ALIGNMENT, 4);
+
+  // encoders
+  encodeDone = false;
+  int numWorkers = glm::max(1, int(thread::hardware_concurrency()) - 1);
+  encodeCapacity = numWorkers * 2;
+  vector<thread> workers;
+  for (int i = 0; i < numWorkers; i++) {
+    workers.push_back(thread(encodeWorker));
+  }
+
+  // render target, only rebuilt when the resolution changes
+  RenderTarget target;
+
+  // double-buffered readback
+  GLuint pbos[2];
+  size_t pboSizes[2] = {0, 0};
+  glGenBuffers(2, pbos);
+
+  map<string, Mesh *> meshes;
+  map<string, Material> materials;
+
+  // the job whose readback is in flight, and its pbo
+  const Job *pending = NULL;
+  int pendingSlot = 0;
+  size_t numImages = 0;
+
+  auto start = chrono::steady_clock::now();
+
+  for (size_t i = 0; i < jobs.size(); i++) {
+    const Job &job = jobs[i];
+    Mesh *mesh = getMesh(meshes, job.mesh);
+    Material &mat = getMaterial(materials, job.material);
+
+    // no empty thumbnails, the reason was reported when loading
+    if (mesh == NULL || mat.base == 0) {
+      cerr << "runBatch: Skipping " << job.output << endl;
+      continue;
+    }
+
+    if (job.width != target.width || job.height != target.height) {
+      target.init(job.width, job.height, BATCH_SAMPLES);
+    }
+
+    target.bind();
+    renderJob(job, mesh, mat);
+    target.resolve();
+
+    // start the asynchronous readback of this job,
+    // into the pbo the pending job doesn't use
+    int slot = pending ? 1 - pendingSlot : 0;
+    size_t size = size_t(job.width) * job.height * 4;
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, target.fbo);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[slot]);
+    if (pboSizes[slot] < size) {
+      glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+      pboSizes[slot] = size;
+    }
+    glReadPixels(0, 0, job.width, job.height, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    // the previous job's transfer had this whole job to complete
+    if (pending) {
+      collectJob(*pending, pbos[pendingSlot]);
+    }
+
+    pending = &job;
+    pendingSlot = slot;
+    numImages++;
+  }
+
+  if (pending) {
+    collectJob(*pending, pbos[pendingSlot]);
+  }
+
+  // wait for the encoders
+  {
+    lock_guard<mutex> lock(encodeMutex);
+    encodeDone = true;
+  }
+  encodeCond.notify_all();
+
+  for (auto &w : workers)
+    w.join();
+
+  chrono::duration<double> dt = chrono::steady_clock::now() - start;
+  printf("%zu images in %.2f s, %.1f images/s\n", numImages, dt.count(),
+         numImages / dt.count());
+
+  // release
+  glDeleteBuffers(2, pbos);
+
+  for (auto &m : materials) {
+    Material &mat = m.second;
+    GLuint tbos[] = {mat.base,   mat.normal, mat.ao,
+                     mat.rough,  mat.height, mat.metallic};
+    glDeleteTextures(6, tbos);
+  }
+
+  for (auto &m : meshes) {
+    delete m.second;
+  }
+  releasePrograms();
+
+  // before the context goes away, the destructor is then a no-op
+  target.release();
+
+  FreeImage_DeInitialise();
+  glfwTerminate();
+
+  // some jobs were skipped, see above
+  return numImages == jobs.size() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
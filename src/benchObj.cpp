@@ -0,0 +1,161 @@
+#include "common.h"
+#include <chrono>
+#include <cstdio>
+
+/* Benchmark readObj against Assimp
+   usage: ./benchObj [scale] [numThreads] [file.obj ...]
+   every input is replicated scale times into a temporary OBJ first,
+   then both importers load it into the vbo layout used by Mesh */
+
+const int NUM_RUNS = 3;
+
+// write the mesh scale times, shifting the face indices of every copy
+size_t writeScaledObj(const string src, const string dst, int scale) {
+  string text = readFile(src);
+  vector<string> lines;
+  int numV = 0, numVt = 0, numVn = 0;
+
+  stringstream in(text);
+  string line;
+  while (getline(in, line)) {
+    if (line.compare(0, 2, "v ") == 0)
+      numV++;
+    else if (line.compare(0, 3, "vt ") == 0)
+      numVt++;
+    else if (line.compare(0, 3, "vn ") == 0)
+      numVn++;
+    lines.push_back(line);
+  }
+
+  ofstream out(dst.c_str());
+
+  for (int k = 0; k < scale; k++) {
+    for (auto &l : lines) {
+      if (l.compare(0, 2, "f ") != 0) {
+        out << l << '\n';
+        continue;
+      }
+
+      stringstream face(l.substr(2));
+      string corner;
+      out << 'f';
+
+      // v, v/vt, v//vn or v/vt/vn, empty fields stay empty and
+      // relative (negative) indices need no shift
+      while (face >> corner) {
+        int shifts[3] = {k * numV, k * numVt, k * numVn};
+        stringstream fields(corner);
+        string field;
+        out << ' ';
+
+        for (int i = 0; i < 3 && getline(fields, field, '/'); i++) {
+          if (i > 0)
+            out << '/';
+          if (field.empty())
+            continue;
+
+          int idx = atoi(field.c_str());
+          out << (idx > 0 ? idx + shifts[i] : idx);
+        }
+      }
+      out << '\n';
+    }
+  }
+
+  return out.tellp();
+}
+
+// what Mesh does with assimp: import, then copy into the vbo layout
+int loadAssimp(const string fileName) {
+  Assimp::Importer importer;
+  const aiScene *scene =
+      importer.ReadFile(fileName, aiProcess_CalcTangentSpace);
+
+  if (!scene) {
+    cerr << importer.GetErrorString() << endl;
+    return 0;
+  }
+
+  int total = 0;
+
+  for (size_t i = 0; i < scene->mNumMeshes; i++) {
+    const aiMesh *mesh = scene->mMeshes[i];
+    int numVtxs = mesh->mNumVertices;
+    vector<GLfloat> aVtxCoords(numVtxs * 3), aUvs(numVtxs * 2),
+        aNormals(numVtxs * 3);
+
+    for (size_t j = 0; j < numVtxs; j++) {
+      aVtxCoords[j * 3 + 0] = mesh->mVertices[j].x;
+      aVtxCoords[j * 3 + 1] = mesh->mVertices[j].y;
+      aVtxCoords[j * 3 + 2] = mesh->mVertices[j].z;
+      aNormals[j * 3 + 0] = mesh->mNormals[j].x;
+      aNormals[j * 3 + 1] = mesh->mNormals[j].y;
+      aNormals[j * 3 + 2] = mesh->mNormals[j].z;
+      aUvs[j * 2 + 0] = mesh->mTextureCoords[0][j].x;
+      aUvs[j * 2 + 1] = mesh->mTextureCoords[0][j].y;
+    }
+
+    total += numVtxs;
+  }
+
+  return total;
+}
+
+int loadReadObj(const string fileName, int numThreads) {
+  ObjData data;
+
+  if (!readObj(fileName, data, numThreads)) {
+    return 0;
+  }
+
+  return data.numVtxs;
+}
+
+// best of NUM_RUNS, in seconds
+template <typename F> double timeIt(F f, int &numVtxs) {
+  double best = 1e30;
+
+  for (int i = 0; i < NUM_RUNS; i++) {
+    auto start = chrono::steady_clock::now();
+    numVtxs = f();
+    chrono::duration<double> dt = chrono::steady_clock::now() - start;
+    best = glm::min(best, dt.count());
+  }
+
+  return best;
+}
+
+int main(int argc, char **argv) {
+  int scale = argc > 1 ? atoi(argv[1]) : 200;
+  int numThreads = argc > 2 ? atoi(argv[2]) : 0;
+
+  vector<string> files;
+  for (int i = 3; i < argc; i++) {
+    files.push_back(argv[i]);
+  }
+  if (files.empty()) {
+    files.push_back("./mesh/sphereQuad.obj");
+    files.push_back("./mesh/gridQuad.obj");
+  }
+
+  for (auto &f : files) {
+    string scaled = f + ".bench.obj";
+    double mb = writeScaledObj(f, scaled, scale) / (1024.0 * 1024.0);
+
+    int nAssimp = 0, nReadObj = 0;
+    double tAssimp = timeIt([&] { return loadAssimp(scaled); }, nAssimp);
+    double tReadObj =
+        timeIt([&] { return loadReadObj(scaled, numThreads); }, nReadObj);
+
+    printf("%s x%d (%.1f MB)\n", f.c_str(), scale, mb);
+    printf("  assimp  : %8.3f s %8.1f MB/s %d vertices\n", tAssimp,
+           mb / tAssimp, nAssimp);
+    printf("  readObj : %8.3f s %8.1f MB/s %d vertices\n", tReadObj,
+           mb / tReadObj, nReadObj);
+    printf("  speedup : %8.2fx\n", tAssimp / tReadObj);
+
+    remove(scaled.c_str());
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -12,19 +12,21 @@ std::string readFile(const std::string fileName) {
 }
 
 // return a shader executable
-GLuint buildShader(string vsDir, string fsDir, string tcsDir, string tesDir) {
+// defines are injected into every stage, see compileShader
+GLuint buildShader(string vsDir, string fsDir, string tcsDir, string tesDir,
+                   string defines) {
   GLuint vs, fs, tcs = 0, tes = 0;
   GLint linkOk;
   GLuint exeShader;
 
   // compile
-  vs = compileShader(vsDir, GL_VERTEX_SHADER);
-  fs = compileShader(fsDir, GL_FRAGMENT_SHADER);
+  vs = compileShader(vsDir, GL_VERTEX_SHADER, defines);
+  fs = compileShader(fsDir, GL_FRAGMENT_SHADER, defines);
 
   // TCS, TES
   if (tcsDir != "" && tesDir != "") {
-    tcs = compileShader(tcsDir, GL_TESS_CONTROL_SHADER);
-    tes = compileShader(tesDir, GL_TESS_EVALUATION_SHADER);
+    tcs = compileShader(tcsDir, GL_TESS_CONTROL_SHADER, defines);
+    tes = compileShader(tesDir, GL_TESS_EVALUATION_SHADER, defines);
   }
 
   // link
@@ -33,10 +35,32 @@ GLuint buildShader(string vsDir, string fsDir, string tcsDir, string tesDir) {
   return exeShader;
 }
 
-GLuint compileShader(string fileName, GLenum type) {
+// return a shader executable without fragment stage
+// whose outputs named by varyings are captured into one interleaved buffer
+GLuint buildFeedbackShader(string vsDir, string tcsDir, string tesDir,
+                           string defines,
+                           const vector<const GLchar *> &varyings) {
+  GLuint vs, tcs, tes;
+
+  vs = compileShader(vsDir, GL_VERTEX_SHADER, defines);
+  tcs = compileShader(tcsDir, GL_TESS_CONTROL_SHADER, defines);
+  tes = compileShader(tesDir, GL_TESS_EVALUATION_SHADER, defines);
+
+  return linkShader(vs, 0, tcs, tes, varyings);
+}
+
+GLuint compileShader(string fileName, GLenum type, string defines) {
   /* read source code */
   string sTemp = readFile(fileName);
   string info;
+
+  // #version must stay the first line, inject the defines right after it
+  if (defines != "") {
+    size_t pos = sTemp.find("#version");
+    pos = (pos == string::npos) ? 0 : sTemp.find('\n', pos) + 1;
+    sTemp.insert(pos, defines);
+  }
+
   const GLchar *source = sTemp.c_str();
 
   switch (type) {
@@ -71,19 +95,30 @@ GLuint compileShader(string fileName, GLenum type) {
   return objShader;
 }
 
-GLuint linkShader(GLuint vsObj, GLuint fsObj, GLuint tcsObj, GLuint tesObj) {
+GLuint linkShader(GLuint vsObj, GLuint fsObj, GLuint tcsObj, GLuint tesObj,
+                  const vector<const GLchar *> &varyings) {
   GLuint exe;
   GLint linkOk;
 
   exe = glCreateProgram();
   glAttachShader(exe, vsObj);
-  glAttachShader(exe, fsObj);
+
+  // no fragment stage when only capturing with transform feedback
+  if (fsObj != 0) {
+    glAttachShader(exe, fsObj);
+  }
 
   if (tcsObj != 0 && tesObj != 0) {
     glAttachShader(exe, tcsObj);
     glAttachShader(exe, tesObj);
   }
 
+  // must be set before linking
+  if (!varyings.empty()) {
+    glTransformFeedbackVaryings(exe, varyings.size(), varyings.data(),
+                                GL_INTERLEAVED_ATTRIBS);
+  }
+
   glLinkProgram(exe);
 
   // check result
@@ -255,31 +290,136 @@ void drawPoints(vector<Point> &pts) { // array data
   glDeleteVertexArrays(1, &vao);
 }
 
+// return a texture object, 0 if the image can't be read
+// with FIF_UNKNOWN the format is guessed from the file
+GLuint loadTexture(const string texDir, FREE_IMAGE_FORMAT imgType) {
+  if (imgType == FIF_UNKNOWN) {
+    imgType = FreeImage_GetFileType(texDir.c_str());
+  }
+
+  FIBITMAP *image = NULL;
+  if (imgType != FIF_UNKNOWN) {
+    image = FreeImage_Load(imgType, texDir.c_str());
+  }
+
+  if (image == NULL) {
+    return 0;
+  }
+
+  FIBITMAP *texImage = FreeImage_ConvertTo24Bits(image);
+
+  GLuint tbo;
+  glGenTextures(1, &tbo);
+  glBindTexture(GL_TEXTURE_2D, tbo);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, FreeImage_GetWidth(texImage),
+               FreeImage_GetHeight(texImage), 0, GL_BGR, GL_UNSIGNED_BYTE,
+               (void *)FreeImage_GetBits(texImage));
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+
+  // release
+  FreeImage_Unload(texImage);
+  FreeImage_Unload(image);
+
+  return tbo;
+}
+
+string getDefines(const ShaderVariant &v) {
+  stringstream ss;
+
+  ss << "#define NUM_LIGHTS " << v.numLights << '\n';
+
+  if (v.useBaseMap)
+    ss << "#define USE_BASE_MAP\n";
+  if (v.useNormalMap)
+    ss << "#define USE_NORMAL_MAP\n";
+  if (v.useAOMap)
+    ss << "#define USE_AO_MAP\n";
+  if (v.useRoughMap)
+    ss << "#define USE_ROUGH_MAP\n";
+  if (v.useMetallic)
+    ss << "#define USE_METALLIC\n";
+  if (v.useTonemap)
+    ss << "#define USE_TONEMAP\n";
+  if (v.useTess)
+    ss << "#define USE_TESS\n";
+  if (v.usePOM)
+    ss << "#define USE_POM\n";
+
+  return ss.str();
+}
+
 /* Mesh class */
 Mesh::Mesh(const string fileName, bool isPbr) {
   // pbr test
   isPBR = isPbr;
+  numLights = 4;
+  tonemap = false;
+
+  // displacement policy
+  displaceMode = DISP_AUTO;
+  tessDist = 8.f;
+  pomDist = 32.f;
+
+  tessScale = 1.f;
+  dispScale = 0.1f;
+
+  // no material yet, see setTexture
+  tboBase = tboNormal = tboAO = tboRough = tboHeight = tboMetallic = 0;
+
+  // tessellation cache, built on first use
+  useTessCache = false;
+  cacheMaxLevel = 16.f;
+  shaderCapture = 0;
+
+  min = vec3(FLT_MAX);
+  max = vec3(-FLT_MAX);
 
   // import mesh
-  scene = importer.ReadFile(fileName, aiProcess_CalcTangentSpace);
+  // OBJ goes through the multithreaded reader, anything else through assimp
+  string ext = fileName.substr(fileName.find_last_of('.') + 1);
+
+  if (ext == "obj" || ext == "OBJ") {
+    ObjData data;
+    scene = NULL;
 
-  initBuffers();
-  initShader();
-  initUniform();
+    if (readObj(fileName, data)) {
+      initBuffers(data);
+    }
+  } else {
+    scene = importer.ReadFile(fileName, aiProcess_CalcTangentSpace);
+
+    if (scene) {
+      initBuffers();
+    } else {
+      cerr << "Mesh: " << importer.GetErrorString() << endl;
+    }
+  }
 }
 
 Mesh::~Mesh() {
-  for (size_t i = 0; i < scene->mNumMeshes; i++) {
+  for (size_t i = 0; i < vaos.size(); i++) {
     glDeleteBuffers(1, &vboVtxs[i]);
     glDeleteBuffers(1, &vboUvs[i]);
     glDeleteBuffers(1, &vboNmls[i]);
+    glDeleteBuffers(1, &ibos[i]);
     glDeleteVertexArrays(1, &vaos[i]);
   }
+
+  for (auto &c : tessCaches) {
+    glDeleteTransformFeedbacks(1, &c.second.tfo);
+    glDeleteBuffers(1, &c.second.vbo);
+    glDeleteVertexArrays(1, &c.second.vao);
+  }
+
+  if (shaderCapture != 0) {
+    glDeleteProgram(shaderCapture);
+  }
 }
 
-void Mesh::initShader() {
+// the glsl files of a permutation, tcs and tes are empty without USE_TESS
+void Mesh::getShaderFiles(const ShaderVariant &variant, string &vs,
+                          string &fs, string &tcs, string &tes) {
   string dir = "./shader/";
-  string vs, fs, tcs, tes;
 
   if (isPBR) {
     vs = dir + "vsPBR.glsl";
@@ -289,29 +429,110 @@ void Mesh::initShader() {
     fs = dir + "fsPhong.glsl";
   }
 
-  tcs = dir + "tcsQuad.glsl";
-  tes = dir + "tesQuad.glsl";
+  if (variant.useTess) {
+    tcs = dir + "tcsQuad.glsl";
+    tes = dir + "tesQuad.glsl";
+  } else {
+    tcs = tes = "";
+  }
+}
+
+// only look up the uniforms the permutation actually uses,
+// the others are compiled out and stay -1 (ignored by glUniform*)
+void Mesh::initUniform(Program &prog, const ShaderVariant &v) {
+  bool useHeight = v.useTess || v.usePOM;
+
+  prog.uniModel = myGetUniformLocation(prog.id, "M");
+  prog.uniView = myGetUniformLocation(prog.id, "V");
+  prog.uniProjection = myGetUniformLocation(prog.id, "P");
+  prog.uniEyePoint = myGetUniformLocation(prog.id, "eyePoint");
+  prog.uniLightColors = myGetUniformLocation(prog.id, "lightColors");
+  prog.uniLightPositions = myGetUniformLocation(prog.id, "lightPositions");
+
+  if (isPBR) {
+    prog.uniTexBase =
+        v.useBaseMap ? myGetUniformLocation(prog.id, "texBase") : -1;
+    prog.uniTexNormal =
+        v.useNormalMap ? myGetUniformLocation(prog.id, "texNormal") : -1;
+    prog.uniTexAO = v.useAOMap ? myGetUniformLocation(prog.id, "texAO") : -1;
+    prog.uniTexRough =
+        v.useRoughMap ? myGetUniformLocation(prog.id, "texRough") : -1;
+    prog.uniTexMetallic =
+        v.useMetallic ? myGetUniformLocation(prog.id, "texMetallic") : -1;
+  } else {
+    // phong always samples base color and normal
+    prog.uniTexBase = myGetUniformLocation(prog.id, "texBase");
+    prog.uniTexNormal = myGetUniformLocation(prog.id, "texNormal");
+    prog.uniTexAO = -1;
+    prog.uniTexRough = -1;
+    prog.uniTexMetallic = -1;
+  }
+
+  prog.uniTexHeight =
+      useHeight ? myGetUniformLocation(prog.id, "texHeight") : -1;
+  prog.uniTessScale =
+      v.useTess ? myGetUniformLocation(prog.id, "tessScale") : -1;
+  prog.uniDispScale =
+      useHeight ? myGetUniformLocation(prog.id, "dispScale") : -1;
+}
+
+// compiled shader permutations shared by all meshes, keyed by their
+// sources and #define block; only the variants requested by draw() are built
+static map<string, Program> programs;
+
+// return the compiled permutation, build it on first request
+Program &Mesh::getProgram(const ShaderVariant &variant) {
+  string vs, fs, tcs, tes;
+  getShaderFiles(variant, vs, fs, tcs, tes);
+
+  string defines = getDefines(variant);
+  string key = vs + ';' + fs + ';' + tcs + ';' + tes + ';' + defines;
+  auto it = programs.find(key);
+
+  if (it == programs.end()) {
+    Program prog;
+    prog.id = buildShader(vs, fs, tcs, tes, defines);
+    initUniform(prog, variant);
+
+    it = programs.insert(make_pair(key, prog)).first;
+  }
+
+  return it->second;
+}
+
+// delete the shared programs, while the context is still alive
+void releasePrograms() {
+  for (auto &p : programs) {
+    glDeleteProgram(p.second.id);
+  }
 
-  shader = buildShader(vs, fs, tcs, tes);
+  programs.clear();
 }
 
-void Mesh::initUniform() {
-  uniModel = myGetUniformLocation(shader, "M");
-  uniView = myGetUniformLocation(shader, "V");
-  uniProjection = myGetUniformLocation(shader, "P");
-  uniEyePoint = myGetUniformLocation(shader, "eyePoint");
-  uniLightColors = myGetUniformLocation(shader, "lightColors");
-  uniLightPositions = myGetUniformLocation(shader, "lightPositions");
-  uniTexBase = myGetUniformLocation(shader, "texBase");
-  uniTexNormal = myGetUniformLocation(shader, "texNormal");
-  uniTexHeight = myGetUniformLocation(shader, "texHeight");
+// the minimum permutation for the current material
+ShaderVariant Mesh::getVariant(DisplaceMode mode) {
+  ShaderVariant v;
+
+  v.numLights = numLights;
+  v.useTess = (mode == DISP_TESS);
 
   if (isPBR) {
-    uniTexAO = myGetUniformLocation(shader, "texAO");
-    uniTexRough = myGetUniformLocation(shader, "texRough");
+    v.useBaseMap = (tboBase != 0);
+    v.useNormalMap = (tboNormal != 0);
+    v.useAOMap = (tboAO != 0);
+    v.useRoughMap = (tboRough != 0);
+    v.useMetallic = (tboMetallic != 0);
+    v.useTonemap = tonemap;
+    v.usePOM = (mode == DISP_POM);
+  } else {
+    v.useBaseMap = v.useNormalMap = v.useAOMap = v.useRoughMap = false;
+    v.useMetallic = v.useTonemap = v.usePOM = false;
   }
+
+  return v;
 }
 
+// from the assimp scene
 void Mesh::initBuffers() {
   // for each mesh
   for (size_t i = 0; i < scene->mNumMeshes; i++) {
@@ -339,41 +560,7 @@ void Mesh::initBuffers() {
       aUvs[j * 2 + 1] = uv.y;
     }
 
-    // vao
-    GLuint vao;
-    glGenVertexArrays(1, &vao);
-    glBindVertexArray(vao);
-    vaos.push_back(vao);
-
-    // vbo for vertex
-    GLuint vboVtx;
-    glGenBuffers(1, &vboVtx);
-    glBindBuffer(GL_ARRAY_BUFFER, vboVtx);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * numVtxs * 3, aVtxCoords,
-                 GL_STATIC_DRAW);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(0);
-    vboVtxs.push_back(vboVtx);
-
-    // vbo for uv
-    GLuint vboUv;
-    glGenBuffers(1, &vboUv);
-    glBindBuffer(GL_ARRAY_BUFFER, vboUv);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * numVtxs * 2, aUvs,
-                 GL_STATIC_DRAW);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(1);
-    vboUvs.push_back(vboUv);
-
-    // vbo for normal
-    GLuint vboNml;
-    glGenBuffers(1, &vboNml);
-    glBindBuffer(GL_ARRAY_BUFFER, vboNml);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * numVtxs * 3, aNormals,
-                 GL_STATIC_DRAW);
-    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(2);
-    vboNmls.push_back(vboNml);
+    addBuffers(aVtxCoords, aUvs, aNormals, numVtxs);
 
     // delete client data
     delete[] aVtxCoords;
@@ -382,52 +569,298 @@ void Mesh::initBuffers() {
   } // end for each mesh
 }
 
+// from readObj, the streams are already in the vbo layout
+void Mesh::initBuffers(ObjData &data) {
+  addBuffers(data.vtxs.data(), data.uvs.data(), data.nmls.data(),
+             data.numVtxs);
+}
+
+// upload one sub-mesh, 4 vertices per quad patch
+void Mesh::addBuffers(GLfloat *aVtxCoords, GLfloat *aUvs, GLfloat *aNormals,
+                      int numVtxs) {
+  // aabb
+  for (size_t j = 0; j < numVtxs; j++) {
+    vec3 vtx = make_vec3(&aVtxCoords[j * 3]);
+    min = glm::min(min, vtx);
+    max = glm::max(max, vtx);
+  }
+
+  this->numVtxs.push_back(numVtxs);
+
+  // vao
+  GLuint vao;
+  glGenVertexArrays(1, &vao);
+  glBindVertexArray(vao);
+  vaos.push_back(vao);
+
+  // vbo for vertex
+  GLuint vboVtx;
+  glGenBuffers(1, &vboVtx);
+  glBindBuffer(GL_ARRAY_BUFFER, vboVtx);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * numVtxs * 3, aVtxCoords,
+               GL_STATIC_DRAW);
+  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+  glEnableVertexAttribArray(0);
+  vboVtxs.push_back(vboVtx);
+
+  // vbo for uv
+  GLuint vboUv;
+  glGenBuffers(1, &vboUv);
+  glBindBuffer(GL_ARRAY_BUFFER, vboUv);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * numVtxs * 2, aUvs,
+               GL_STATIC_DRAW);
+  glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, 0);
+  glEnableVertexAttribArray(1);
+  vboUvs.push_back(vboUv);
+
+  // vbo for normal
+  GLuint vboNml;
+  glGenBuffers(1, &vboNml);
+  glBindBuffer(GL_ARRAY_BUFFER, vboNml);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * numVtxs * 3, aNormals,
+               GL_STATIC_DRAW);
+  glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, 0);
+  glEnableVertexAttribArray(2);
+  vboNmls.push_back(vboNml);
+
+  // ibo for the non-tess path
+  // every 4 vertices form a quad patch, split it into 2 triangles
+  int numQuads = numVtxs / 4;
+  GLuint *aIdxs = new GLuint[numQuads * 6];
+
+  for (size_t j = 0; j < numQuads; j++) {
+    GLuint base = j * 4;
+    aIdxs[j * 6 + 0] = base + 0;
+    aIdxs[j * 6 + 1] = base + 1;
+    aIdxs[j * 6 + 2] = base + 2;
+    aIdxs[j * 6 + 3] = base + 0;
+    aIdxs[j * 6 + 4] = base + 2;
+    aIdxs[j * 6 + 5] = base + 3;
+  }
+
+  GLuint ibo;
+  glGenBuffers(1, &ibo);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * numQuads * 6, aIdxs,
+               GL_STATIC_DRAW);
+  ibos.push_back(ibo);
+
+  delete[] aIdxs;
+}
+
 void Mesh::setTexture(GLuint &tbo, int texUnit, const string texDir,
                       FREE_IMAGE_FORMAT imgType) {
   glActiveTexture(GL_TEXTURE0 + texUnit);
 
-  FIBITMAP *texImage =
-      FreeImage_ConvertTo24Bits(FreeImage_Load(imgType, texDir.c_str()));
+  tbo = loadTexture(texDir, imgType);
+}
 
-  glGenTextures(1, &tbo);
-  glBindTexture(GL_TEXTURE_2D, tbo);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, FreeImage_GetWidth(texImage),
-               FreeImage_GetHeight(texImage), 0, GL_BGR, GL_UNSIGNED_BYTE,
-               (void *)FreeImage_GetBits(texImage));
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+// distance from the eye to the bounding sphere of the transformed aabb
+float Mesh::eyeDistance(mat4 M, vec3 eye) {
+  vec3 center = vec3(M * vec4((min + max) * 0.5f, 1.f));
+  float radius = length(vec3(M * vec4((max - min) * 0.5f, 0.f)));
 
-  // release
-  FreeImage_Unload(texImage);
+  return glm::max(distance(eye, center) - radius, 0.f);
+}
+
+// same buckets as getTessLevel in tcsQuad.glsl, for the whole mesh
+float Mesh::getTessLevel(float dist) {
+  float baseDist = 4.f, baseLevel = 1.f;
+  float level = baseLevel * 32.f;
+
+  for (float d = baseDist; d < baseDist * 32.f && dist > d; d *= 2.f) {
+    level *= 0.5f;
+  }
+
+  return glm::clamp(level * tessScale, 1.f, cacheMaxLevel);
+}
+
+// uniform scale of a model matrix, the geometric mean for non-uniform ones,
+// snapped to steps of ~1% so a few frames of float noise share a cache
+float Mesh::modelScale(mat4 M) {
+  float s = glm::max(cbrt(abs(determinant(mat3(M)))), 1e-6f);
+
+  return exp2(round(log2(s) * 64.f) / 64.f);
+}
+
+DisplaceMode Mesh::selectDisplaceMode(mat4 M, vec3 eye) {
+  if (displaceMode != DISP_AUTO) {
+    return displaceMode;
+  }
+
+  float dist = eyeDistance(M, eye);
+
+  if (dist <= tessDist) {
+    return DISP_TESS;
+  } else if (dist <= pomDist) {
+    return DISP_POM;
+  } else {
+    return DISP_NONE;
+  }
+}
+
+void Mesh::initCapture() {
+  string dir = "./shader/";
+  string vs = dir + (isPBR ? "vsPBR.glsl" : "vsPhong.glsl");
+
+  // tesQuad outputs, in the order of the TessCache vao attributes;
+  // captured with an identity M, so they are in object space despite the names
+  vector<const GLchar *> varyings = {"worldPos", "uv", "worldN"};
+
+  shaderCapture =
+      buildFeedbackShader(vs, dir + "tcsQuad.glsl", dir + "tesQuad.glsl",
+                          "#define FIXED_TESS_LEVEL\n", varyings);
+
+  uniCaptureModel = myGetUniformLocation(shaderCapture, "M");
+  uniCaptureTessLevel = myGetUniformLocation(shaderCapture, "tessLevel");
+  uniCaptureTexHeight = myGetUniformLocation(shaderCapture, "texHeight");
+  uniCaptureDispScale = myGetUniformLocation(shaderCapture, "dispScale");
+
+  glUseProgram(shaderCapture);
+  glUniformMatrix4fv(uniCaptureModel, 1, GL_FALSE, value_ptr(mat4(1.f)));
+}
+
+// the capture of a level bucket and model scale,
+// (re)built when missing or stale
+TessCache &Mesh::getTessCache(float level, float scale, int unitHeight) {
+  auto it = tessCaches.find(make_pair(level, scale));
+
+  if (it == tessCaches.end()) {
+    TessCache cache;
+
+    glGenTransformFeedbacks(1, &cache.tfo);
+    glGenBuffers(1, &cache.vbo);
+
+    // interleaved position, uv, normal
+    GLsizei stride = sizeof(GLfloat) * 8;
+
+    glGenVertexArrays(1, &cache.vao);
+    glBindVertexArray(cache.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, cache.vbo);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, 0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride,
+                          (GLvoid *)(sizeof(GLfloat) * 3));
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, stride,
+                          (GLvoid *)(sizeof(GLfloat) * 5));
+    glEnableVertexAttribArray(2);
+
+    it = tessCaches.insert(make_pair(make_pair(level, scale), cache)).first;
+    captureTess(it->second, level, scale, unitHeight);
+  } else if (it->second.dispScale != dispScale ||
+             it->second.texHeight != tboHeight) {
+    captureTess(it->second, level, scale, unitHeight);
+  }
+
+  return it->second;
+}
+
+// run the tessellation once with a fixed level
+// and keep the displaced triangles in the cache's vbo
+void Mesh::captureTess(TessCache &cache, float level, float scale,
+                       int unitHeight) {
+  if (shaderCapture == 0) {
+    initCapture();
+  }
+
+  // equal_spacing rounds the level up, ceil(level)^2 sub-quads,
+  // 2 triangles each
+  size_t numQuads = 0;
+  for (size_t i = 0; i < numVtxs.size(); i++) {
+    numQuads += numVtxs[i] / 4;
+  }
+  size_t n = size_t(ceil(level));
+  size_t numCacheVtxs = numQuads * n * n * 6;
+
+  glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, cache.tfo);
+  glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, cache.vbo);
+  glBufferData(GL_TRANSFORM_FEEDBACK_BUFFER,
+               sizeof(GLfloat) * 8 * numCacheVtxs, NULL, GL_STATIC_COPY);
+
+  // tesQuad displaces in object units here, the live path in world units,
+  // so undo the model scale to get the same surface
+  glUseProgram(shaderCapture);
+  glUniform1f(uniCaptureTessLevel, level);
+  glUniform1i(uniCaptureTexHeight, unitHeight);
+  glUniform1f(uniCaptureDispScale, dispScale / scale);
+
+  glEnable(GL_RASTERIZER_DISCARD);
+  glBeginTransformFeedback(GL_TRIANGLES);
+
+  for (size_t i = 0; i < vaos.size(); i++) {
+    glBindVertexArray(vaos[i]);
+    glDrawArrays(GL_PATCHES, 0, numVtxs[i]);
+  }
+
+  glEndTransformFeedback();
+  glDisable(GL_RASTERIZER_DISCARD);
+  glBindTransformFeedback(GL_TRANSFORM_FEEDBACK, 0);
+
+  cache.dispScale = dispScale;
+  cache.texHeight = tboHeight;
 }
 
 void Mesh::draw(mat4 M, mat4 V, mat4 P, vec3 eye, vec3 lightColors[],
                 vec3 lightPositions[], int unitBaseColor, int unitNormal,
-                int unitAO, int unitRough, int unitHeight) {
-  glUseProgram(shader);
-
-  glUniformMatrix4fv(uniModel, 1, GL_FALSE, value_ptr(M));
-  glUniformMatrix4fv(uniView, 1, GL_FALSE, value_ptr(V));
-  glUniformMatrix4fv(uniProjection, 1, GL_FALSE, value_ptr(P));
+                int unitAO, int unitRough, int unitHeight, int unitMetallic) {
+  DisplaceMode mode = selectDisplaceMode(M, eye);
 
-  glUniform3fv(uniEyePoint, 1, value_ptr(eye));
+  // nothing to displace without a height map
+  if (tboHeight == 0) {
+    mode = DISP_NONE;
+  }
 
-  glUniform3fv(uniLightColors, 4, value_ptr(lightColors[0]));
-  glUniform3fv(uniLightPositions, 4, value_ptr(lightPositions[0]));
+  ShaderVariant variant = getVariant(mode);
 
-  glUniform1i(uniTexBase, unitBaseColor); // change base color
-  glUniform1i(uniTexNormal, unitNormal);  // change normal
-  glUniform1i(uniTexHeight, unitHeight);  // change height map
+  // replay the captured geometry instead of tessellating again,
+  // through the plain vs which applies M like for any other mesh
+  bool drawCache = (mode == DISP_TESS && useTessCache);
+  TessCache *cache = NULL;
 
-  if (isPBR) {
-    glUniform1i(uniTexAO, unitAO);       // change ambient occlusion
-    glUniform1i(uniTexRough, unitRough); // change roughness
+  if (drawCache) {
+    float level = getTessLevel(eyeDistance(M, eye));
+    cache = &getTessCache(level, modelScale(M), unitHeight);
+    variant.useTess = false;
   }
 
-  for (size_t i = 0; i < scene->mNumMeshes; i++) {
-    int numVtxs = scene->mMeshes[i]->mNumVertices;
+  Program &prog = getProgram(variant);
 
+  glUseProgram(prog.id);
+
+  glUniformMatrix4fv(prog.uniModel, 1, GL_FALSE, value_ptr(M));
+  glUniformMatrix4fv(prog.uniView, 1, GL_FALSE, value_ptr(V));
+  glUniformMatrix4fv(prog.uniProjection, 1, GL_FALSE, value_ptr(P));
+
+  glUniform3fv(prog.uniEyePoint, 1, value_ptr(eye));
+
+  glUniform3fv(prog.uniLightColors, numLights, value_ptr(lightColors[0]));
+  glUniform3fv(prog.uniLightPositions, numLights,
+               value_ptr(lightPositions[0]));
+
+  glUniform1i(prog.uniTexBase, unitBaseColor);    // change base color
+  glUniform1i(prog.uniTexNormal, unitNormal);     // change normal
+  glUniform1i(prog.uniTexHeight, unitHeight);     // change height map
+  glUniform1i(prog.uniTexAO, unitAO);             // change ambient occlusion
+  glUniform1i(prog.uniTexRough, unitRough);       // change roughness
+  glUniform1i(prog.uniTexMetallic, unitMetallic); // change metallic
+
+  glUniform1f(prog.uniTessScale, tessScale);
+  glUniform1f(prog.uniDispScale, dispScale);
+
+  if (drawCache) {
+    glBindVertexArray(cache->vao);
+    glDrawTransformFeedback(GL_TRIANGLES, cache->tfo);
+    return;
+  }
+
+  for (size_t i = 0; i < vaos.size(); i++) {
     glBindVertexArray(vaos[i]);
-    // glDrawArrays(GL_TRIANGLES, 0, numVtxs);
-    glDrawArrays(GL_PATCHES, 0, numVtxs);
+
+    if (mode == DISP_TESS) {
+      glDrawArrays(GL_PATCHES, 0, numVtxs[i]);
+    } else {
+      glDrawElements(GL_TRIANGLES, numVtxs[i] / 4 * 6, GL_UNSIGNED_INT, 0);
+    }
   }
 }
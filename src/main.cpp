@@ -4,6 +4,10 @@ GLFWwindow *window;
 
 Mesh *mesh;
 
+// runtime quality, see QualityController
+QualityController *quality;
+float frameBudget = 16.6f; // ms, can be given as the first argument
+
 /* for view control */
 float verticalAngle = -2.13668;
 float horizontalAngle = 0.0107599;
@@ -41,6 +45,15 @@ void initTexture();
 void releaseResource();
 
 int main(int argc, char **argv) {
+  // offline material previews, see batch.cpp
+  if (argc > 2 && string(argv[1]) == "--batch") {
+    return runBatch(argv[2]);
+  }
+
+  if (argc > 1) {
+    frameBudget = atof(argv[1]);
+  }
+
   initGL();
   initOthers();
 
@@ -63,8 +76,16 @@ int main(int argc, char **argv) {
   glfwPollEvents();
   glfwSetCursorPos(window, WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2);
 
+  int frameCount = 0;
+
   /* Loop until the user closes the window */
   while (!glfwWindowShouldClose(window)) {
+    // render into the offscreen target at the current quality
+    int fbWidth, fbHeight;
+    glfwGetFramebufferSize(window, &fbWidth, &fbHeight);
+    quality->beginFrame(fbWidth, fbHeight);
+    mesh->tessScale = quality->current().tessScale;
+
     // reset
     glClearColor(0.f, 0.f, 0.4f, 0.f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -81,7 +102,7 @@ int main(int argc, char **argv) {
         tempModel = scale(tempModel, vec3(3.f, 3.f, 3.f));
 
         mesh->draw(tempModel, view, projection, eyePoint, lightColors,
-                   lightPositions, 12, 13, 14, 15, 16);
+                   lightPositions, 12, 13, 14, 15, 16, 17);
       }
     }
 
@@ -91,6 +112,14 @@ int main(int argc, char **argv) {
     glUniformMatrix4fv(uniPointP, 1, GL_FALSE, value_ptr(projection));
     drawPoints(pts);
 
+    quality->endFrame(fbWidth, fbHeight);
+
+    // show the chosen levels
+    if (++frameCount % 30 == 0) {
+      string title = "PBR | " + quality->stats();
+      glfwSetWindowTitle(window, title.c_str());
+    }
+
     /* Swap front and back buffers */
     glfwSwapBuffers(window);
 
@@ -179,10 +208,24 @@ void keyCallback(GLFWwindow *keyWnd, int key, int scancode, int action,
       glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
       break;
     }
+    case GLFW_KEY_M: {
+      // cycle none -> pom -> tess -> auto
+      mesh->displaceMode = DisplaceMode((mesh->displaceMode + 1) % 4);
+
+      const char *names[] = {"none", "pom", "tess", "auto"};
+      std::cout << "displaceMode: " << names[mesh->displaceMode] << '\n';
+      break;
+    }
+    case GLFW_KEY_C: {
+      mesh->useTessCache = !mesh->useTessCache;
+      std::cout << "useTessCache: " << mesh->useTessCache << '\n';
+      break;
+    }
     case GLFW_KEY_I: {
       std::cout << "eyePoint: " << to_string(eyePoint) << '\n';
       std::cout << "verticleAngle: " << fmod(verticalAngle, 6.28f) << ", "
                 << "horizontalAngle: " << fmod(horizontalAngle, 6.28f) << endl;
+      std::cout << "quality: " << quality->stats() << endl;
       break;
     }
     default:
@@ -200,7 +243,9 @@ void initGL() { // Initialise GLFW
 
   // without setting GLFW_CONTEXT_VERSION_MAJOR and _MINOR，
   // OpenGL 1.x will be used
-  glfwWindowHint(GLFW_SAMPLES, 4);
+  // MSAA is done in the offscreen target of QualityController,
+  // a multisampled default framebuffer can't be blitted into
+  glfwWindowHint(GLFW_SAMPLES, 0);
   glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
   glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
 
@@ -249,6 +294,8 @@ void initOthers() {
   uniPointM = myGetUniformLocation(pointShader, "M");
   uniPointV = myGetUniformLocation(pointShader, "V");
   uniPointP = myGetUniformLocation(pointShader, "P");
+
+  quality = new QualityController(frameBudget);
 }
 
 void initMatrix() {
@@ -267,6 +314,9 @@ void initTexture() {
 }
 
 void releaseResource() {
+  delete quality;
+  releasePrograms();
+
   glfwTerminate();
   FreeImage_DeInitialise();
 
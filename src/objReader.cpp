@@ -0,0 +1,450 @@
+#include "common.h"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Multithreaded OBJ reader
+   1. memory-map the file and cut it into chunks at line boundaries
+   2. parse the chunks in parallel, each into its own v/vt/vn/face lists
+   3. prefix-sum the per-chunk counts, then gather every face corner
+      straight into the GPU vertex layout, again one thread per chunk */
+
+// only split files larger than this, threads cost more than they save below
+const size_t MIN_CHUNK_SIZE = 1 << 20;
+
+// a face corner, indices are 0-based, INT_MIN if missing
+// negative (relative) OBJ indices can only be resolved against the chunk,
+// they are flagged in rel and made global once the chunk offsets are known
+typedef struct {
+  int v, vt, vn;
+  unsigned char rel; // bit 0: v, bit 1: vt, bit 2: vn
+} Corner;
+
+typedef struct {
+  const char *begin, *end;
+
+  vector<float> vtxs, uvs, nmls;
+  vector<Corner> corners; // 4 per face
+
+  // offsets into the global arrays, filled after parsing
+  size_t vtxOffset, uvOffset, nmlOffset, cornerOffset;
+} Chunk;
+
+static inline bool isSpace(char c) { return c == ' ' || c == '\t'; }
+
+static inline const char *skipSpace(const char *p, const char *end) {
+  while (p < end && isSpace(*p))
+    p++;
+  return p;
+}
+
+static inline const char *skipLine(const char *p, const char *end) {
+  while (p < end && *p != '\n')
+    p++;
+  return p < end ? p + 1 : end;
+}
+
+static const double POW10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,
+                               1e7,  1e8,  1e9,  1e10, 1e11, 1e12, 1e13,
+                               1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+                               1e21, 1e22};
+
+// parse [sign] digits [. digits] [e [sign] digits]
+// much faster than strtod since it ignores locale and rounding corner cases,
+// precise enough for single-precision vertex data
+static const char *parseFloat(const char *p, const char *end, float &out) {
+  p = skipSpace(p, end);
+
+  bool neg = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    neg = (*p == '-');
+    p++;
+  }
+
+  uint64_t mantissa = 0;
+  int numDigits = 0, exponent = 0;
+
+  while (p < end && *p >= '0' && *p <= '9') {
+    if (numDigits < 19) {
+      mantissa = mantissa * 10 + (*p - '0');
+      numDigits++;
+    } else {
+      exponent++;
+    }
+    p++;
+  }
+
+  if (p < end && *p == '.') {
+    p++;
+    while (p < end && *p >= '0' && *p <= '9') {
+      if (numDigits < 19) {
+        mantissa = mantissa * 10 + (*p - '0');
+        numDigits++;
+        exponent--;
+      }
+      p++;
+    }
+  }
+
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    p++;
+    bool expNeg = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+      expNeg = (*p == '-');
+      p++;
+    }
+
+    int e = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+      e = e * 10 + (*p - '0');
+      p++;
+    }
+    exponent += expNeg ? -e : e;
+  }
+
+  double value = double(mantissa);
+  while (exponent > 22) {
+    value *= 1e22;
+    exponent -= 22;
+  }
+  while (exponent < -22) {
+    value /= 1e22;
+    exponent += 22;
+  }
+  value = exponent >= 0 ? value * POW10[exponent] : value / POW10[-exponent];
+
+  out = float(neg ? -value : value);
+
+  return p;
+}
+
+static const char *parseInt(const char *p, const char *end, int &out) {
+  bool neg = false;
+  if (p < end && *p == '-') {
+    neg = true;
+    p++;
+  }
+
+  int value = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    value = value * 10 + (*p - '0');
+    p++;
+  }
+
+  out = neg ? -value : value;
+
+  return p;
+}
+
+// OBJ index to 0-based, see Corner
+static inline int resolveIndex(int idx, size_t localCount, bool &rel) {
+  rel = (idx < 0);
+
+  if (idx > 0)
+    return idx - 1;
+  if (idx < 0)
+    return int(localCount) + idx; // may point into a previous chunk
+  return INT_MIN;
+}
+
+// 0-based index into a global pool, or -1
+static inline long globalIndex(int idx, bool rel, size_t offset,
+                               size_t count) {
+  if (idx == INT_MIN)
+    return -1;
+
+  long g = rel ? long(offset) + idx : idx;
+
+  return (g >= 0 && g < long(count)) ? g : -1;
+}
+
+// v, v/vt, v//vn, v/vt/vn
+static const char *parseCorner(const char *p, const char *end, Chunk &chunk,
+                               Corner &c) {
+  int v = 0, vt = 0, vn = 0;
+
+  p = parseInt(p, end, v);
+  if (p < end && *p == '/') {
+    p++;
+    if (p < end && *p != '/')
+      p = parseInt(p, end, vt);
+    if (p < end && *p == '/') {
+      p++;
+      p = parseInt(p, end, vn);
+    }
+  }
+
+  bool relV, relVt, relVn;
+  c.v = resolveIndex(v, chunk.vtxs.size() / 3, relV);
+  c.vt = resolveIndex(vt, chunk.uvs.size() / 2, relVt);
+  c.vn = resolveIndex(vn, chunk.nmls.size() / 3, relVn);
+  c.rel = relV | (relVt << 1) | (relVn << 2);
+
+  return p;
+}
+
+static void parseChunk(Chunk &chunk) {
+  const char *p = chunk.begin, *end = chunk.end;
+  vector<Corner> poly;
+
+  while (p < end) {
+    p = skipSpace(p, end);
+
+    if (p + 1 < end && p[0] == 'v' && isSpace(p[1])) {
+      float x, y, z;
+      p = parseFloat(p + 2, end, x);
+      p = parseFloat(p, end, y);
+      p = parseFloat(p, end, z);
+      chunk.vtxs.push_back(x);
+      chunk.vtxs.push_back(y);
+      chunk.vtxs.push_back(z);
+    } else if (p + 2 < end && p[0] == 'v' && p[1] == 't' && isSpace(p[2])) {
+      float u, v;
+      p = parseFloat(p + 3, end, u);
+      p = parseFloat(p, end, v);
+      chunk.uvs.push_back(u);
+      chunk.uvs.push_back(v);
+    } else if (p + 2 < end && p[0] == 'v' && p[1] == 'n' && isSpace(p[2])) {
+      float x, y, z;
+      p = parseFloat(p + 3, end, x);
+      p = parseFloat(p, end, y);
+      p = parseFloat(p, end, z);
+      chunk.nmls.push_back(x);
+      chunk.nmls.push_back(y);
+      chunk.nmls.push_back(z);
+    } else if (p + 1 < end && p[0] == 'f' && isSpace(p[1])) {
+      poly.clear();
+      p = skipSpace(p + 2, end);
+
+      while (p < end && *p != '\n' && *p != '\r' && *p != '#') {
+        Corner c;
+        const char *next = parseCorner(p, end, chunk, c);
+
+        // malformed corner, drop the rest of the line
+        if (next == p)
+          break;
+
+        poly.push_back(c);
+        p = skipSpace(next, end);
+      }
+
+      // quads go through as they are, the GL_PATCHES path wants them;
+      // other polygons are fanned into triangles stored as degenerate quads
+      if (poly.size() == 4) {
+        chunk.corners.insert(chunk.corners.end(), poly.begin(), poly.end());
+      } else {
+        for (size_t i = 1; i + 1 < poly.size(); i++) {
+          chunk.corners.push_back(poly[0]);
+          chunk.corners.push_back(poly[i]);
+          chunk.corners.push_back(poly[i + 1]);
+          chunk.corners.push_back(poly[i + 1]);
+        }
+      }
+    }
+
+    // o, g, s, usemtl, mtllib, comments... are ignored
+    p = skipLine(p, end);
+  }
+}
+
+// unit normal of a quad from its diagonals, counter-clockwise is front
+// (a degenerate quad, i.e. a triangle, gives the triangle's normal)
+static void faceNormal(const float *p0, const float *p1, const float *p2,
+                       const float *p3, float *n) {
+  float a[3] = {p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]};
+  float b[3] = {p3[0] - p1[0], p3[1] - p1[1], p3[2] - p1[2]};
+
+  n[0] = a[1] * b[2] - a[2] * b[1];
+  n[1] = a[2] * b[0] - a[0] * b[2];
+  n[2] = a[0] * b[1] - a[1] * b[0];
+
+  float len = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+
+  // collapsed face, any unit vector keeps normalize() in the shaders finite
+  if (len < 1e-12f) {
+    n[0] = 0.f;
+    n[1] = 1.f;
+    n[2] = 0.f;
+    return;
+  }
+
+  n[0] /= len;
+  n[1] /= len;
+  n[2] /= len;
+}
+
+// copy one chunk's faces into the output streams
+// attribute g of a global pool, read from the chunk that parsed it;
+// usually the current chunk, otherwise a binary search over the offsets
+// (of equal offsets the last chunk wins, the earlier ones are empty)
+static inline const float *findAttrib(const vector<Chunk> &chunks,
+                                      const Chunk &chunk, long g,
+                                      size_t Chunk::*offset,
+                                      vector<float> Chunk::*attrib, int n) {
+  size_t i = g;
+  const Chunk *owner = &chunk;
+
+  if (i < chunk.*offset || i >= chunk.*offset + (chunk.*attrib).size() / n) {
+    auto it = upper_bound(
+        chunks.begin(), chunks.end(), i,
+        [offset](size_t idx, const Chunk &c) { return idx < c.*offset; });
+    owner = &*(it - 1);
+  }
+
+  return &(owner->*attrib)[(i - owner->*offset) * n];
+}
+
+static void gatherChunk(const vector<Chunk> &chunks, size_t chunkIdx,
+                        size_t numVtxs, size_t numUvs, size_t numNmls,
+                        ObjData &data) {
+  const Chunk &chunk = chunks[chunkIdx];
+
+  // every face is 4 corners, see parseChunk
+  for (size_t f = 0; f < chunk.corners.size(); f += 4) {
+    bool missingNml = false;
+
+    for (size_t k = 0; k < 4; k++) {
+      const Corner &c = chunk.corners[f + k];
+      size_t dst = chunk.cornerOffset + f + k;
+
+      long v = globalIndex(c.v, c.rel & 1, chunk.vtxOffset, numVtxs);
+      long vt = globalIndex(c.vt, c.rel & 2, chunk.uvOffset, numUvs);
+      long vn = globalIndex(c.vn, c.rel & 4, chunk.nmlOffset, numNmls);
+
+      // missing or invalid positions and uvs stay 0
+      if (v >= 0) {
+        copy_n(findAttrib(chunks, chunk, v, &Chunk::vtxOffset, &Chunk::vtxs, 3),
+               3, &data.vtxs[dst * 3]);
+      }
+      if (vt >= 0) {
+        copy_n(findAttrib(chunks, chunk, vt, &Chunk::uvOffset, &Chunk::uvs, 2),
+               2, &data.uvs[dst * 2]);
+      }
+      if (vn >= 0) {
+        copy_n(
+            findAttrib(chunks, chunk, vn, &Chunk::nmlOffset, &Chunk::nmls, 3),
+            3, &data.nmls[dst * 3]);
+      } else {
+        missingNml = true;
+      }
+    }
+
+    // a zero normal would give NaNs in the shaders,
+    // corners without one get the face normal instead
+    if (missingNml) {
+      const float *p = &data.vtxs[(chunk.cornerOffset + f) * 3];
+      float n[3];
+      faceNormal(p, p + 3, p + 6, p + 9, n);
+
+      for (size_t k = 0; k < 4; k++) {
+        const Corner &c = chunk.corners[f + k];
+        long vn = globalIndex(c.vn, c.rel & 4, chunk.nmlOffset, numNmls);
+
+        if (vn < 0) {
+          copy_n(n, 3, &data.nmls[(chunk.cornerOffset + f + k) * 3]);
+        }
+      }
+    }
+  }
+}
+
+bool readObj(const string fileName, ObjData &data, int numThreads) {
+  int fd = open(fileName.c_str(), O_RDONLY);
+  if (fd < 0) {
+    cerr << "readObj: Can't open " << fileName << endl;
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    cerr << "readObj: Empty or unreadable file " << fileName << endl;
+    close(fd);
+    return false;
+  }
+
+  size_t size = st.st_size;
+  void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (addr == MAP_FAILED) {
+    cerr << "readObj: Can't map " << fileName << endl;
+    return false;
+  }
+
+  const char *text = (const char *)addr;
+
+  // cut into chunks at line boundaries
+  if (numThreads <= 0) {
+    numThreads = std::max(1u, thread::hardware_concurrency());
+  }
+
+  size_t numChunks = std::min<size_t>(numThreads, size / MIN_CHUNK_SIZE + 1);
+  vector<Chunk> chunks(numChunks);
+  const char *p = text, *end = text + size;
+
+  for (size_t i = 0; i < numChunks; i++) {
+    const char *chunkEnd = text + size / numChunks * (i + 1);
+
+    if (i == numChunks - 1 || chunkEnd > end)
+      chunkEnd = end;
+
+    while (chunkEnd < end && chunkEnd[-1] != '\n')
+      chunkEnd++;
+
+    chunks[i].begin = p;
+    chunks[i].end = chunkEnd;
+    p = chunkEnd;
+  }
+
+  // parse
+  vector<thread> workers;
+  for (size_t i = 1; i < numChunks; i++) {
+    workers.push_back(thread(parseChunk, ref(chunks[i])));
+  }
+  parseChunk(chunks[0]);
+
+  for (auto &w : workers)
+    w.join();
+  workers.clear();
+
+  munmap(addr, size);
+
+  // prefix sums
+  size_t numVtxs = 0, numUvs = 0, numNmls = 0, numCorners = 0;
+
+  for (auto &c : chunks) {
+    c.vtxOffset = numVtxs;
+    c.uvOffset = numUvs;
+    c.nmlOffset = numNmls;
+    c.cornerOffset = numCorners;
+
+    numVtxs += c.vtxs.size() / 3;
+    numUvs += c.uvs.size() / 2;
+    numNmls += c.nmls.size() / 3;
+    numCorners += c.corners.size();
+  }
+
+  // gather into the GPU layout, straight from the chunks' attributes;
+  // a chunk that only holds faces may reference any other chunk
+  data.numVtxs = numCorners;
+  data.vtxs.assign(numCorners * 3, 0.f);
+  data.uvs.assign(numCorners * 2, 0.f);
+  data.nmls.assign(numCorners * 3, 0.f);
+
+  for (size_t i = 1; i < numChunks; i++) {
+    workers.push_back(thread(gatherChunk, cref(chunks), i, numVtxs, numUvs,
+                             numNmls, ref(data)));
+  }
+  gatherChunk(chunks, 0, numVtxs, numUvs, numNmls, data);
+
+  for (auto &w : workers)
+    w.join();
+
+  return true;
+}
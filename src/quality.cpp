@@ -0,0 +1,151 @@
+#include "common.h"
+
+/* Quality controller */
+
+// degrade above budget * DEGRADE, improve below budget * IMPROVE,
+// the gap avoids oscillating between two levels
+const float DEGRADE = 1.05f;
+const float IMPROVE = 0.75f;
+
+// frames to wait after a change, lets frameTime settle on the new level
+const int COOLDOWN = 60;
+
+// weight of the newest sample in frameTime
+const float SMOOTHING = 0.1f;
+
+// frames after which a level measured over budget is tried again,
+// in case the scene got cheaper since
+const int RETRY = 1200;
+
+QualityController::QualityController(float budgetMs) {
+  // cheapest knobs first: MSAA, then tessellation, then resolution
+  levels = {{1.f, 4, 1.f},    {1.f, 2, 1.f},     {1.f, 0, 1.f},
+            {1.f, 0, 0.5f},   {0.75f, 0, 0.5f},  {0.75f, 0, 0.25f},
+            {0.5f, 0, 0.25f}, {0.5f, 0, 0.125f}};
+  level = 0;
+
+  budget = budgetMs;
+  frameTime = budgetMs;
+  cooldown = COOLDOWN;
+  frame = 0;
+
+  levelTimes.assign(levels.size(), 0.f);
+  levelFrames.assign(levels.size(), 0);
+
+  glGenQueries(NUM_QUERIES, queries);
+  for (int i = 0; i < NUM_QUERIES; i++) {
+    queryIssued[i] = false;
+  }
+  queryIdx = 0;
+}
+
+QualityController::~QualityController() {
+  glDeleteQueries(NUM_QUERIES, queries);
+}
+
+const QualityLevel &QualityController::current() { return levels[level]; }
+
+// bind the offscreen target and start timing
+void QualityController::beginFrame(int fbWidth, int fbHeight) {
+  const QualityLevel &q = current();
+  int w = glm::max(1, int(fbWidth * q.renderScale));
+  int h = glm::max(1, int(fbHeight * q.renderScale));
+
+  if (w != target.width || h != target.height ||
+      q.samples != target.samples) {
+    target.init(w, h, q.samples);
+  }
+
+  target.bind();
+
+  glBeginQuery(GL_TIME_ELAPSED, queries[queryIdx]);
+}
+
+// stop timing, resolve and upscale into the default framebuffer
+void QualityController::endFrame(int fbWidth, int fbHeight) {
+  // multisample resolve needs equal sizes, so resolve first, then scale
+  target.resolve();
+
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, target.fbo);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+  glBlitFramebuffer(0, 0, target.width, target.height, 0, 0, fbWidth,
+                    fbHeight, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glViewport(0, 0, fbWidth, fbHeight);
+
+  glEndQuery(GL_TIME_ELAPSED);
+  queryIssued[queryIdx] = true;
+  queryIdx = (queryIdx + 1) % NUM_QUERIES;
+
+  readQueries();
+  adapt();
+}
+
+// the query about to be reused is the oldest one, NUM_QUERIES - 1 frames
+// behind; it is normally available by now, if not skip it this frame
+void QualityController::readQueries() {
+  GLuint query = queries[queryIdx];
+
+  if (!queryIssued[queryIdx]) {
+    return;
+  }
+
+  GLint available = 0;
+  glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+
+  if (available) {
+    GLuint64 ns = 0;
+    glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+    queryIssued[queryIdx] = false;
+
+    float ms = ns / 1e6f;
+    frameTime += (ms - frameTime) * SMOOTHING;
+  }
+}
+
+void QualityController::adapt() {
+  frame++;
+
+  if (cooldown > 0) {
+    cooldown--;
+    return;
+  }
+
+  // settled on this level, remember what it costs
+  levelTimes[level] = frameTime;
+  levelFrames[level] = frame;
+
+  int next = level;
+
+  // a step can change the cost by more than the IMPROVE/DEGRADE gap,
+  // only go back up to a level that fit the budget when last measured
+  if (frameTime > budget * DEGRADE && level + 1 < levels.size()) {
+    next = level + 1;
+  } else if (frameTime < budget * IMPROVE && level > 0 &&
+             worthTrying(level - 1)) {
+    next = level - 1;
+  }
+
+  if (next != level) {
+    level = next;
+    cooldown = COOLDOWN;
+  }
+}
+
+// never measured, measured within budget, or measured too long ago to tell
+bool QualityController::worthTrying(int l) {
+  return levelTimes[l] <= budget || frame - levelFrames[l] > RETRY;
+}
+
+string QualityController::stats() {
+  const QualityLevel &q = current();
+  stringstream ss;
+
+  ss.precision(3);
+  ss << "gpu " << frameTime << " / " << budget << " ms, "
+     << "level " << level << ": " << target.width << "x" << target.height
+     << ", " << q.samples << "x MSAA, tess " << q.tessScale;
+
+  return ss.str();
+}
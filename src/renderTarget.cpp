@@ -0,0 +1,101 @@
+#include "common.h"
+
+/* Offscreen render target */
+
+RenderTarget::RenderTarget() {
+  width = height = samples = 0;
+  fboMS = rboMSColor = rboMSDepth = 0;
+  fbo = rboColor = rboDepth = 0;
+}
+
+RenderTarget::~RenderTarget() { release(); }
+
+void RenderTarget::init(int w, int h, int numSamples) {
+  release();
+
+  width = w;
+  height = h;
+  samples = numSamples;
+
+  // resolved target, also the render target without MSAA
+  glGenRenderbuffers(1, &rboColor);
+  glBindRenderbuffer(GL_RENDERBUFFER, rboColor);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+  glGenRenderbuffers(1, &rboDepth);
+  glBindRenderbuffer(GL_RENDERBUFFER, rboDepth);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+
+  glGenFramebuffers(1, &fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                            GL_RENDERBUFFER, rboColor);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                            GL_RENDERBUFFER, rboDepth);
+
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+    cerr << "RenderTarget: Offscreen target is incomplete." << endl;
+  }
+
+  // multisampled target
+  if (samples > 0) {
+    glGenRenderbuffers(1, &rboMSColor);
+    glBindRenderbuffer(GL_RENDERBUFFER, rboMSColor);
+    glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_RGBA8, width,
+                                     height);
+
+    glGenRenderbuffers(1, &rboMSDepth);
+    glBindRenderbuffer(GL_RENDERBUFFER, rboMSDepth);
+    glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples,
+                                     GL_DEPTH_COMPONENT24, width, height);
+
+    glGenFramebuffers(1, &fboMS);
+    glBindFramebuffer(GL_FRAMEBUFFER, fboMS);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                              GL_RENDERBUFFER, rboMSColor);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                              GL_RENDERBUFFER, rboMSDepth);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+      cerr << "RenderTarget: Multisampled target is incomplete." << endl;
+    }
+  }
+
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void RenderTarget::release() {
+  // nothing to do, also keeps a released target from calling into gl
+  // after the context is gone
+  if (fbo == 0) {
+    return;
+  }
+
+  // glDelete* ignores 0
+  glDeleteFramebuffers(1, &fboMS);
+  glDeleteRenderbuffers(1, &rboMSColor);
+  glDeleteRenderbuffers(1, &rboMSDepth);
+  glDeleteFramebuffers(1, &fbo);
+  glDeleteRenderbuffers(1, &rboColor);
+  glDeleteRenderbuffers(1, &rboDepth);
+
+  fboMS = rboMSColor = rboMSDepth = 0;
+  fbo = rboColor = rboDepth = 0;
+}
+
+// draw into the multisampled fbo if any, over the whole target
+void RenderTarget::bind() {
+  glBindFramebuffer(GL_FRAMEBUFFER, samples > 0 ? fboMS : fbo);
+  glViewport(0, 0, width, height);
+}
+
+// resolve the multisampled image into fbo, nothing to do without MSAA
+void RenderTarget::resolve() {
+  if (samples > 0) {
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fboMS);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo);
+    glBlitFramebuffer(0, 0, width, height, 0, 0, width, height,
+                      GL_COLOR_BUFFER_BIT, GL_NEAREST);
+  }
+}